@@ -32,6 +32,10 @@
 #include <libswscale/swscale.h>
 #include <libavutil/opt.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #define AV_TIME_BASE_SEC    (AVRational){1, 1}
 
@@ -40,6 +44,128 @@ struct PreProcessChanges {
     int width, height;
 };
 
+struct EncoderPreset {
+    const char *name;
+    int qscale;                 /* JPEG quantizer, lower is better */
+    int compression_level;      /* PNG deflate level, -1 is zlib default */
+    int prediction_method;      /* PNG row filter */
+};
+
+/* input format is always the encoder's own (full range yuvj for JPEG),
+ * range conversion is folded into resample and skipped for yuvj sources */
+static const struct EncoderPreset encoder_presets[] = {
+    { "fast",     4,  1, 0 },
+    { "balanced", 3, -1, 0 },
+    /* mixed PNG filter chooses best one for every row */
+    { "small",    6,  9, 5 },
+};
+
+struct EncodeJob {
+    AVFrame *frame;             /* owns picture at data[0] */
+    char filename[1024];
+    struct EncodeJob *next;
+};
+
+struct EncoderWorker {
+    pthread_t thread;
+    int is_started;
+    AVFormatContext *format_ctx;
+    AVCodecContext *enc_ctx;
+    struct EncoderPool *pool;
+};
+
+struct EncoderPool {
+    struct EncoderWorker *workers;
+    int nb_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      /* new job was queued or finish requested */
+    pthread_cond_t drained;     /* some job was taken */
+    struct EncodeJob *head, *tail;
+    int pending, max_pending;
+    int finish;
+    int error;
+    struct AsyncWriter *writer;
+};
+
+enum FsyncPolicy {
+    FSYNC_NONE,     /* leave flushing to the OS */
+    FSYNC_FILE,     /* fsync every output file before closing it */
+    FSYNC_END,      /* flush everything once at the end of the job */
+};
+
+struct WriteJob {
+    char filename[1024];
+    uint8_t *buf;
+    int size;
+    struct WriteJob *next;
+};
+
+struct AsyncWriter {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      /* new job was queued or finish requested */
+    pthread_cond_t drained;     /* some bytes left the queue */
+    struct WriteJob *head, *tail;
+    struct WriteJob *written;   /* files waiting for fsync at the end */
+    int64_t in_flight, max_in_flight;
+    enum FsyncPolicy fsync;
+    int finish;
+    int error;
+};
+
+struct FrameCacheEntry {
+    int64_t first_ts, last_ts;  /* goals resolving to this frame */
+    struct PreProcessChanges changes;
+    int is_deinterlace, is_crop;
+    struct PreProcessChanges picture;
+    AVPicture pic;
+    int size;
+    struct FrameCacheEntry *next;
+};
+
+/* most recently used entry is the head */
+struct FrameCache {
+    struct FrameCacheEntry *head;
+    int64_t size, max_size;
+    int hits, misses;
+};
+
+enum ScalerPreset {
+    SCALER_FAST,        /* fast bilinear */
+    SCALER_BALANCED,    /* area when reducing twice or more, else bicubic */
+    SCALER_QUALITY,     /* lanczos */
+};
+
+#define SCALER_CACHE_SIZE 4
+
+struct ScalerCacheEntry {
+    struct SwsContext *ctx;
+    struct PreProcessChanges src;
+    struct PreProcessChanges dst;
+    int flags;
+    unsigned last_used;
+};
+
+/* per thread, since SwsContext can not be shared between threads */
+struct ScalerCache {
+    struct ScalerCacheEntry entries[SCALER_CACHE_SIZE];
+    unsigned clock;
+};
+
+struct BandScaler {
+    struct SwsContext *sws_ctx;
+    int flags;
+    struct PreProcessChanges src;
+    struct PreProcessChanges dst;
+    AVPicture pic;              /* scaled picture which is being filled */
+    const uint8_t *src_data;    /* buffer, number and pts of picture */
+    int src_number;             /* bands belong to, buffers are reused */
+    int64_t src_pts;
+    int64_t goal;               /* pictures before it are not scaled */
+    int next_y;
+    int valid;
+};
+
 struct PreProcessSettings {
     struct PreProcessChanges source;
     struct PreProcessChanges result;
@@ -51,6 +177,8 @@ struct PreProcessSettings {
 
     int is_crop;
     struct PreProcessChanges crop;
+
+    enum ScalerPreset scaler;
 };
 
 static inline char *av_dict_get_val(AVDictionary *m, const char *key, const AVDictionaryEntry *prev, int flags)
@@ -180,12 +308,18 @@ static void choose_pixel_fmt(AVCodecContext *enc_ctx, AVCodec *codec_dst)
     }
 }
 
-static AVFrame *aquire_frame(AVFormatContext *fmt_ctx, AVCodecContext *dec_ctx, int stream_idx, int64_t ts)
+/* first_ts..frame_ts is range of goals which would give the same frame,
+ * frame_ts is AV_NOPTS_VALUE when frame at goal was not reached */
+static AVFrame *aquire_frame(AVFormatContext *fmt_ctx, AVCodecContext *dec_ctx, int stream_idx, int64_t ts,
+                             struct BandScaler *band, int64_t *first_ts, int64_t *frame_ts)
 {
     int ret, got_frame;
     AVFrame *frame;
     AVPacket pkt;
     int64_t *best_effort_timestamp;
+    int64_t prev_ts = AV_NOPTS_VALUE;
+
+    *first_ts = *frame_ts = AV_NOPTS_VALUE;
 
     /* initialize packet */
     av_init_packet(&pkt);
@@ -214,6 +348,10 @@ static AVFrame *aquire_frame(AVFormatContext *fmt_ctx, AVCodecContext *dec_ctx,
             }
         } while (pkt.stream_index != stream_idx);
 
+        /* band scaler needs dts when packets carry no pts */
+        if (band)
+            dec_ctx->reordered_opaque = pkt.dts;
+
         /* decode video packet to frame */
         ret = avcodec_decode_video2(dec_ctx, frame, &got_frame, &pkt);
         if (ret < 0) {
@@ -223,16 +361,42 @@ static AVFrame *aquire_frame(AVFormatContext *fmt_ctx, AVCodecContext *dec_ctx,
             return NULL;
         } else if (!ret)
             av_log(NULL, AV_LOG_DEBUG, "No frame was decoded\n");
-        else if (got_frame)
+        else if (got_frame) {
             av_dlog(NULL, "Got frame size:%d bet:%"PRId64"\n", ret, *best_effort_timestamp);
+            if (*best_effort_timestamp < ts) {
+                prev_ts = *best_effort_timestamp;
+                /* its bands, if any were scaled, must not be taken later */
+                if (band)
+                    band->valid = 0;
+            }
+        }
     } while (!got_frame || *best_effort_timestamp < ts);
 
     av_free_packet(&pkt);
 
+    /* goals after previous frame up to this one resolve here */
+    *frame_ts = *best_effort_timestamp;
+    *first_ts = prev_ts != (int64_t) AV_NOPTS_VALUE ? prev_ts + 1 : ts;
+
     return frame;
 }
 
-static int init_encoder_context(const char *filename, AVCodecContext *dec_ctx, AVFormatContext **format_ctx_ptr, AVCodecContext **enc_ctx_ptr)
+static void apply_encoder_preset(AVCodecContext *enc_ctx,
+                                 const struct EncoderPreset *preset)
+{
+    if (enc_ctx->codec_id == CODEC_ID_MJPEG) {
+        enc_ctx->qmin    = enc_ctx->qmax = preset->qscale;
+        enc_ctx->mb_lmin = enc_ctx->lmin = enc_ctx->qmin * FF_QP2LAMBDA;
+        enc_ctx->mb_lmax = enc_ctx->lmax = enc_ctx->qmax * FF_QP2LAMBDA;
+        enc_ctx->global_quality = enc_ctx->qmin * FF_QP2LAMBDA;
+        enc_ctx->flags |= CODEC_FLAG_QSCALE;
+    } else if (enc_ctx->codec_id == CODEC_ID_PNG) {
+        enc_ctx->compression_level = preset->compression_level;
+        enc_ctx->prediction_method = preset->prediction_method;
+    }
+}
+
+static int init_encoder_context(const char *filename, AVCodecContext *dec_ctx, const struct EncoderPreset *preset, AVFormatContext **format_ctx_ptr, AVCodecContext **enc_ctx_ptr)
 {
     AVOutputFormat *format;
     AVFormatContext *format_ctx;
@@ -286,13 +450,10 @@ static int init_encoder_context(const char *filename, AVCodecContext *dec_ctx, A
     enc_ctx->width      = dec_ctx->width;
     enc_ctx->height     = dec_ctx->height;
     enc_ctx->codec_type = dec_ctx->codec_type;
+    enc_ctx->codec_id   = codec_id;
 
-    /*
-    enc_ctx->qmin    = enc_ctx->qmax = 3;
-    enc_ctx->mb_lmin = enc_ctx->lmin = enc_ctx->qmin * FF_QP2LAMBDA;
-    enc_ctx->mb_lmax = enc_ctx->lmax = enc_ctx->qmax * FF_QP2LAMBDA;
-    enc_ctx->flags |= CODEC_FLAG_QSCALE | CODEC_FLAG_INPUT_PRESERVED;
-    */
+    /* quality and compression effort */
+    apply_encoder_preset(enc_ctx, preset);
 
     if (format_ctx->oformat->flags & AVFMT_GLOBALHEADER)
         enc_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
@@ -309,7 +470,210 @@ static int init_encoder_context(const char *filename, AVCodecContext *dec_ctx, A
     return 0;
 }
 
-static int encode_video_frame(AVFormatContext *format_ctx, AVCodecContext *enc_ctx, AVFrame *frame)
+static int write_file(const char *filename, const uint8_t *buf, int size, int sync)
+{
+    int fd, ret = 0;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Could not open '%s' for writing\n", filename);
+        return ret;
+    }
+
+    while (size > 0) {
+        ssize_t written = write(fd, buf, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = AVERROR(errno);
+            av_log(NULL, AV_LOG_ERROR, "Could not write '%s'\n", filename);
+            break;
+        }
+        buf  += written;
+        size -= written;
+    }
+
+    if (!ret && sync && fsync(fd) < 0) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Could not sync '%s'\n", filename);
+    }
+
+    if (close(fd) < 0 && !ret)
+        ret = AVERROR(errno);
+
+    return ret;
+}
+
+static void *async_writer_thread(void *arg)
+{
+    struct AsyncWriter *w = arg;
+    struct WriteJob *batch, *job;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->head && !w->finish)
+            pthread_cond_wait(&w->queued, &w->lock);
+        if (!w->head)
+            break;
+
+        /* take whole queue at once, everything queued meanwhile
+         * is written in a single pass without touching the lock */
+        batch = w->head;
+        w->head = w->tail = NULL;
+        pthread_mutex_unlock(&w->lock);
+
+        while ((job = batch)) {
+            int size = job->size;
+            int ret = write_file(job->filename, job->buf, job->size,
+                                 w->fsync == FSYNC_FILE);
+
+            av_log(NULL, AV_LOG_DEBUG, "Written %d bytes to %s\n",
+                                        size, job->filename);
+            batch = job->next;
+            av_freep(&job->buf);
+            if (w->fsync == FSYNC_END && ret >= 0) {
+                /* only writer thread touches it until it is joined */
+                job->next = w->written;
+                w->written = job;
+            } else
+                av_free(job);
+
+            pthread_mutex_lock(&w->lock);
+            if (ret < 0 && !w->error)
+                w->error = ret;
+            w->in_flight -= size;
+            /* waiters wait for room of different size, wake them all */
+            pthread_cond_broadcast(&w->drained);
+            pthread_mutex_unlock(&w->lock);
+        }
+
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+static int async_writer_init(struct AsyncWriter *w, int64_t max_in_flight,
+                             enum FsyncPolicy fsync)
+{
+    int ret;
+
+    memset(w, 0, sizeof(*w));
+    w->max_in_flight = max_in_flight;
+    w->fsync = fsync;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->queued, NULL);
+    pthread_cond_init(&w->drained, NULL);
+
+    ret = pthread_create(&w->thread, NULL, async_writer_thread, w);
+    if (ret) {
+        av_log(NULL, AV_LOG_FATAL, "Could not start writer thread\n");
+        pthread_cond_destroy(&w->drained);
+        pthread_cond_destroy(&w->queued);
+        pthread_mutex_destroy(&w->lock);
+        return AVERROR(ret);
+    }
+
+    return 0;
+}
+
+/* takes ownership of buf, blocks while too much data is waiting for disk,
+ * write errors are reported by async_writer_close */
+static int async_writer_push(struct AsyncWriter *w, const char *filename,
+                             uint8_t *buf, int size)
+{
+    struct WriteJob *job;
+
+    job = av_mallocz(sizeof(*job));
+    if (!job) {
+        av_free(buf);
+        return AVERROR(ENOMEM);
+    }
+    av_strlcpy(job->filename, filename, sizeof(job->filename));
+    job->buf  = buf;
+    job->size = size;
+
+    pthread_mutex_lock(&w->lock);
+    /* backpressure: a single oversized job is still allowed through */
+    while (w->in_flight && w->in_flight + size > w->max_in_flight)
+        pthread_cond_wait(&w->drained, &w->lock);
+
+    if (w->tail)
+        w->tail->next = job;
+    else
+        w->head = job;
+    w->tail = job;
+    w->in_flight += size;
+
+    pthread_cond_signal(&w->queued);
+    pthread_mutex_unlock(&w->lock);
+
+    return 0;
+}
+
+/* waits until everything is written and returns first error if any */
+static int async_writer_close(struct AsyncWriter *w)
+{
+    struct WriteJob *job;
+
+    pthread_mutex_lock(&w->lock);
+    w->finish = 1;
+    pthread_cond_signal(&w->queued);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+
+    /* flush only files of this job, not whole system */
+    while ((job = w->written)) {
+        int fd = open(job->filename, O_RDONLY);
+
+        if (fd < 0 || fsync(fd) < 0) {
+            if (!w->error)
+                w->error = AVERROR(errno);
+            av_log(NULL, AV_LOG_ERROR, "Could not sync '%s'\n", job->filename);
+        }
+        if (fd >= 0)
+            close(fd);
+
+        w->written = job->next;
+        av_free(job);
+    }
+
+    pthread_cond_destroy(&w->drained);
+    pthread_cond_destroy(&w->queued);
+    pthread_mutex_destroy(&w->lock);
+
+    return w->error;
+}
+
+/* writer gets whole muxed file from memory, so muxer has to write through
+ * pb; image2 opens files by itself, but image2pipe writes same to pb */
+static int async_writer_prepare_format(AVFormatContext *format_ctx,
+                                       const char *filename)
+{
+    AVOutputFormat *format;
+    const char *ext = strrchr(filename, '.');
+
+    if (!(format_ctx->oformat->flags & AVFMT_NOFILE))
+        return 0;
+
+    /* split planes are written by image2 to separate files */
+    if (strcmp(format_ctx->oformat->name, "image2")
+        || (ext && !av_strcasecmp(ext + 1, "y")))
+        return AVERROR(ENOSYS);
+
+    format = av_guess_format("image2pipe", NULL, NULL);
+    if (!format)
+        return AVERROR_MUXER_NOT_FOUND;
+    format_ctx->oformat = format;
+
+    return 0;
+}
+
+static int encode_video_frame(AVFormatContext *format_ctx, AVCodecContext *enc_ctx, AVFrame *frame, struct AsyncWriter *writer)
 {
     int ret = 0;
     AVStream *stream;
@@ -326,6 +690,13 @@ static int encode_video_frame(AVFormatContext *format_ctx, AVCodecContext *enc_c
     ctx_tmp = stream->codec;
     stream->codec = enc_ctx;
 
+    /* mux into memory, file is written by writer thread */
+    if (writer) {
+        ret = avio_open_dyn_buf(&format_ctx->pb);
+        if (ret < 0)
+            goto end;
+    }
+
     ret = avformat_write_header(format_ctx, NULL);
     if (ret < 0) {
         char buf[64];
@@ -372,6 +743,18 @@ static int encode_video_frame(AVFormatContext *format_ctx, AVCodecContext *enc_c
             goto free_pkt;
         }
 
+        if (writer) {
+            uint8_t *buf;
+            int size = avio_close_dyn_buf(format_ctx->pb, &buf);
+
+            format_ctx->pb = NULL;
+            ret = async_writer_push(writer, format_ctx->filename, buf, size);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Can't queue a frame\n");
+                goto free_pkt;
+            }
+        }
+
         av_log(NULL, AV_LOG_DEBUG, "Sucess at encoding frame to %s\n",
                                     format_ctx->filename);
 
@@ -384,23 +767,310 @@ free_pkt:
     av_free(video_outbuf);
 
 end:
+    if (writer && format_ctx->pb) {
+        uint8_t *buf;
+        avio_close_dyn_buf(format_ctx->pb, &buf);
+        av_free(buf);
+        format_ctx->pb = NULL;
+    }
     if (ctx_tmp)
         stream->codec = ctx_tmp;
 
     return ret;
 }
 
-int resample_frame(AVFrame *frame, struct PreProcessChanges *dst)
+static pthread_key_t scaler_cache_key;
+static pthread_once_t scaler_cache_once = PTHREAD_ONCE_INIT;
+
+static void scaler_cache_destroy(void *arg)
+{
+    struct ScalerCache *cache = arg;
+
+    for (int i = 0; i < SCALER_CACHE_SIZE; ++i)
+        if (cache->entries[i].ctx)
+            sws_freeContext(cache->entries[i].ctx);
+    av_free(cache);
+}
+
+static void scaler_cache_key_init(void)
+{
+    pthread_key_create(&scaler_cache_key, scaler_cache_destroy);
+}
+
+/* frees cache of calling thread, others free their caches on exit */
+static void scaler_cache_release(void)
+{
+    struct ScalerCache *cache;
+
+    pthread_once(&scaler_cache_once, scaler_cache_key_init);
+    cache = pthread_getspecific(scaler_cache_key);
+    if (cache) {
+        pthread_setspecific(scaler_cache_key, NULL);
+        scaler_cache_destroy(cache);
+    }
+}
+
+static struct SwsContext *scaler_get_context(int src_w, int src_h,
+                                             enum PixelFormat src_fmt,
+                                             int dst_w, int dst_h,
+                                             enum PixelFormat dst_fmt, int flags)
+{
+    struct ScalerCache *cache;
+    struct ScalerCacheEntry *entry, *lru;
+
+    pthread_once(&scaler_cache_once, scaler_cache_key_init);
+    cache = pthread_getspecific(scaler_cache_key);
+    if (!cache) {
+        cache = av_mallocz(sizeof(*cache));
+        if (!cache || pthread_setspecific(scaler_cache_key, cache)) {
+            av_free(cache);
+            return NULL;
+        }
+    }
+
+    lru = &cache->entries[0];
+    for (int i = 0; i < SCALER_CACHE_SIZE; ++i) {
+        entry = &cache->entries[i];
+        if (entry->ctx && entry->flags == flags
+            && entry->src.width == src_w && entry->src.height == src_h
+            && entry->src.format == src_fmt
+            && entry->dst.width == dst_w && entry->dst.height == dst_h
+            && entry->dst.format == dst_fmt) {
+            entry->last_used = ++cache->clock;
+            return entry->ctx;
+        }
+        if (!entry->ctx || (lru->ctx && entry->last_used < lru->last_used))
+            lru = entry;
+    }
+
+    /* evict least recently used context */
+    if (lru->ctx)
+        sws_freeContext(lru->ctx);
+    lru->ctx = sws_getContext(src_w, src_h, src_fmt, dst_w, dst_h, dst_fmt,
+                              flags, NULL, NULL, NULL);
+    lru->src.width  = src_w;
+    lru->src.height = src_h;
+    lru->src.format = src_fmt;
+    lru->dst.width  = dst_w;
+    lru->dst.height = dst_h;
+    lru->dst.format = dst_fmt;
+    lru->flags = flags;
+    lru->last_used = ++cache->clock;
+
+    return lru->ctx;
+}
+
+static int scaler_flags(int src_w, int src_h, int dst_w, int dst_h,
+                        enum ScalerPreset preset)
 {
+    int is_downscale = dst_w < src_w || dst_h < src_h;
+
+    switch (preset) {
+    case SCALER_FAST:
+        return SWS_FAST_BILINEAR;
+    case SCALER_QUALITY:
+        return SWS_LANCZOS;
+    default:
+        /* area averaging is cheaper and sharper enough when reduced twice */
+        if (is_downscale && src_w >= 2 * dst_w && src_h >= 2 * dst_h)
+            return SWS_AREA;
+        return SWS_BICUBIC;
+    }
+}
+
+static void *encoder_worker_thread(void *arg)
+{
+    struct EncoderWorker *worker = arg;
+    struct EncoderPool *pool = worker->pool;
+    struct EncodeJob *job;
     int ret;
-    static struct SwsContext *sws_ctx = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->finish)
+            pthread_cond_wait(&pool->queued, &pool->lock);
+        if (!(job = pool->head))
+            break;
+
+        pool->head = job->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pool->pending--;
+        pthread_cond_signal(&pool->drained);
+        pthread_mutex_unlock(&pool->lock);
+
+        av_strlcpy(worker->format_ctx->filename, job->filename,
+                   sizeof(worker->format_ctx->filename));
+        ret = encode_video_frame(worker->format_ctx, worker->enc_ctx,
+                                 job->frame, pool->writer);
+
+        av_free(job->frame->data[0]);
+        av_free(job->frame);
+        av_free(job);
+
+        pthread_mutex_lock(&pool->lock);
+        if (ret < 0 && !pool->error)
+            pool->error = ret;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/* workers get own encoders, same as main one, opened with given size */
+static int encoder_pool_init(struct EncoderPool *pool, int nb_workers,
+                             const char *filename, AVCodecContext *dec_ctx,
+                             const struct EncoderPreset *preset,
+                             struct PreProcessChanges *result,
+                             struct AsyncWriter *writer)
+{
+    int ret;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->max_pending = 2 * nb_workers;
+    pool->writer = writer;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->drained, NULL);
+
+    pool->workers = av_mallocz(nb_workers * sizeof(*pool->workers));
+    if (!pool->workers)
+        return AVERROR(ENOMEM);
+
+    while (pool->nb_workers < nb_workers) {
+        /* counted at once, so close cleans up partially initialized one */
+        struct EncoderWorker *worker = &pool->workers[pool->nb_workers++];
+
+        worker->pool = pool;
+        ret = init_encoder_context(filename, dec_ctx, preset,
+                                   &worker->format_ctx, &worker->enc_ctx);
+        if (ret < 0)
+            return ret;
+        if (writer) {
+            ret = async_writer_prepare_format(worker->format_ctx, filename);
+            if (ret < 0)
+                return ret;
+        }
+
+        worker->enc_ctx->pix_fmt = result->format;
+        worker->enc_ctx->width   = result->width;
+        worker->enc_ctx->height  = result->height;
+        ret = avcodec_open2(worker->enc_ctx, worker->enc_ctx->codec, NULL);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Could not open codec %s\n",
+                                       worker->enc_ctx->codec->name);
+            return ret;
+        }
+
+        ret = pthread_create(&worker->thread, NULL, encoder_worker_thread, worker);
+        if (ret) {
+            av_log(NULL, AV_LOG_FATAL, "Could not start encoder thread\n");
+            return AVERROR(ret);
+        }
+        worker->is_started = 1;
+    }
+
+    return 0;
+}
+
+/* takes ownership of frame owning its picture, otherwise copies picture;
+ * encode errors are reported by encoder_pool_close */
+static int encoder_pool_push(struct EncoderPool *pool, AVFrame *frame,
+                             const char *filename, int owns_picture)
+{
+    struct EncodeJob *job;
+
+    if (!owns_picture) {
+        AVPicture pic;
+        AVFrame *copy = avcodec_alloc_frame();
+
+        if (!copy || avpicture_alloc(&pic, frame->format,
+                                     frame->width, frame->height) < 0) {
+            av_free(copy);
+            return AVERROR(ENOMEM);
+        }
+        av_picture_copy(&pic, (AVPicture *) frame, frame->format,
+                        frame->width, frame->height);
+
+        for (int i = 0; i < AV_NUM_DATA_POINTERS; ++i) {
+            copy->data[i] = pic.data[i];
+            copy->linesize[i] = pic.linesize[i];
+        }
+        copy->format = frame->format;
+        copy->width  = frame->width;
+        copy->height = frame->height;
+        frame = copy;
+    }
+
+    job = av_mallocz(sizeof(*job));
+    if (!job) {
+        av_free(frame->data[0]);
+        av_free(frame);
+        return AVERROR(ENOMEM);
+    }
+    job->frame = frame;
+    av_strlcpy(job->filename, filename, sizeof(job->filename));
+
+    pthread_mutex_lock(&pool->lock);
+    /* backpressure: decoder should not run far ahead of encoders */
+    while (pool->pending >= pool->max_pending)
+        pthread_cond_wait(&pool->drained, &pool->lock);
+
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pool->pending++;
+
+    pthread_cond_signal(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/* waits until all queued frames are encoded and returns first error */
+static int encoder_pool_close(struct EncoderPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->finish = 1;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->nb_workers; ++i) {
+        struct EncoderWorker *worker = &pool->workers[i];
+
+        if (worker->is_started)
+            pthread_join(worker->thread, NULL);
+        if (worker->format_ctx)
+            avformat_free_context(worker->format_ctx);
+        if (worker->enc_ctx) {
+            avcodec_close(worker->enc_ctx);
+            av_free(worker->enc_ctx);
+        }
+    }
+    av_free(pool->workers);
+
+    pthread_cond_destroy(&pool->drained);
+    pthread_cond_destroy(&pool->queued);
+    pthread_mutex_destroy(&pool->lock);
+
+    return pool->error;
+}
+
+int resample_frame(AVFrame *frame, struct PreProcessChanges *dst,
+                   enum ScalerPreset preset)
+{
+    int ret;
+    struct SwsContext *sws_ctx;
     AVPicture pic;
     uint8_t *buf;
 
-    sws_ctx = sws_getCachedContext(sws_ctx,
-                                   frame->width, frame->height, frame->format,
-                                   dst->width, dst->height, dst->format,
-                                   SWS_BICUBIC, NULL, NULL, NULL);
+    sws_ctx = scaler_get_context(frame->width, frame->height, frame->format,
+                                 dst->width, dst->height, dst->format,
+                                 scaler_flags(frame->width, frame->height,
+                                              dst->width, dst->height, preset));
     if (!sws_ctx) {
         av_log(NULL, AV_LOG_FATAL,
                "Impossible to create scale context for the conversion "
@@ -431,6 +1101,117 @@ int resample_frame(AVFrame *frame, struct PreProcessChanges *dst)
     return ret;
 }
 
+/* called by decoder for every decoded band while it is still in cache */
+static void band_scaler_draw(AVCodecContext *dec_ctx, const AVFrame *src,
+                             int offset[AV_NUM_DATA_POINTERS],
+                             int y, int type, int height)
+{
+    struct BandScaler *bs = dec_ctx->opaque;
+    const uint8_t *slice[AV_NUM_DATA_POINTERS];
+
+    if (!y) {
+        bs->src_data = src->data[0];
+        bs->src_number = src->coded_picture_number;
+        bs->src_pts = src->pkt_pts;
+        bs->next_y = 0;
+        bs->valid = 0;
+
+        /* context was made for initial geometry, which may change */
+        if (dec_ctx->width != bs->src.width || dec_ctx->height != bs->src.height
+            || dec_ctx->pix_fmt != bs->src.format)
+            return;
+
+        /* only pictures known to be at goal or after it are scaled, dts
+         * from reordered_opaque never exceeds pts, so it is safe bound */
+        if (src->pkt_pts != (int64_t) AV_NOPTS_VALUE) {
+            if (src->pkt_pts < bs->goal)
+                return;
+        } else if (src->reordered_opaque == (int64_t) AV_NOPTS_VALUE
+                   || src->reordered_opaque < bs->goal)
+            return;
+
+        if (!bs->pic.data[0] && avpicture_alloc(&bs->pic, bs->dst.format,
+                                               bs->dst.width, bs->dst.height) < 0)
+            return;
+
+        /* context stays untouched until picture ends, nothing else
+         * is scaled by this thread while decoding */
+        bs->sws_ctx = scaler_get_context(bs->src.width, bs->src.height,
+                                         bs->src.format,
+                                         bs->dst.width, bs->dst.height,
+                                         bs->dst.format, bs->flags);
+        bs->valid = !!bs->sws_ctx;
+    }
+
+    /* bands must come in order and cover whole picture, otherwise
+     * frame will be scaled as a whole after decoding */
+    if (!bs->valid || src->data[0] != bs->src_data || y != bs->next_y) {
+        bs->valid = 0;
+        return;
+    }
+
+    for (int i = 0; i < AV_NUM_DATA_POINTERS; ++i)
+        slice[i] = src->data[i] ? src->data[i] + offset[i] : NULL;
+
+    sws_scale(bs->sws_ctx, slice, src->linesize, y, height,
+              bs->pic.data, bs->pic.linesize);
+    bs->next_y = y + height;
+}
+
+static void band_scaler_init(struct BandScaler *bs, AVCodecContext *dec_ctx,
+                             struct PreProcessSettings *ppvfs)
+{
+    memset(bs, 0, sizeof(*bs));
+    bs->src = ppvfs->source;
+    bs->dst = ppvfs->resample;
+    bs->flags = scaler_flags(bs->src.width, bs->src.height,
+                             bs->dst.width, bs->dst.height, ppvfs->scaler);
+
+    dec_ctx->opaque = bs;
+    dec_ctx->slice_flags = 0;
+    dec_ctx->draw_horiz_band = band_scaler_draw;
+}
+
+static void band_scaler_reset(struct BandScaler *bs, int64_t goal)
+{
+    bs->goal = goal;
+    bs->src_data = NULL;
+    bs->valid = 0;
+}
+
+/* moves scaled picture into frame if all its bands were scaled */
+static int band_scaler_take(struct BandScaler *bs, AVFrame *frame)
+{
+    if (!bs->valid || frame->data[0] != bs->src_data
+                   || frame->width  != bs->src.width
+                   || frame->height != bs->src.height
+                   || frame->format != bs->src.format
+                   || frame->coded_picture_number != bs->src_number
+                   || frame->pkt_pts != bs->src_pts
+                   || bs->next_y < bs->src.height)
+        return 0;
+
+    for (int i = 0; i < AV_NUM_DATA_POINTERS; ++i) {
+        frame->data[i] = bs->pic.data[i];
+        frame->linesize[i] = bs->pic.linesize[i];
+    }
+
+    frame->format = bs->dst.format;
+    frame->width  = bs->dst.width;
+    frame->height = bs->dst.height;
+
+    /* frame owns buffer now */
+    memset(&bs->pic, 0, sizeof(bs->pic));
+    bs->valid = 0;
+
+    return 1;
+}
+
+static void band_scaler_free(struct BandScaler *bs)
+{
+    avpicture_free(&bs->pic);
+}
+
 static void pre_process_init(AVDictionary *options, struct PreProcessSettings *ppvfs)
 {
     char *tmp;
@@ -443,6 +1224,18 @@ static void pre_process_init(AVDictionary *options, struct PreProcessSettings *p
     /* deinterlace */
     ppvfs->is_deinterlace = !!av_dict_get_fcval(options, "deinterlace");
 
+    /* scaling algorithm */
+    ppvfs->scaler = SCALER_BALANCED;
+    tmp = av_dict_get_fcval(options, "scaler");
+    if (tmp) {
+        if (!strcmp(tmp, "fast"))
+            ppvfs->scaler = SCALER_FAST;
+        else if (!strcmp(tmp, "quality"))
+            ppvfs->scaler = SCALER_QUALITY;
+        else if (strcmp(tmp, "balanced"))
+            av_log(NULL, AV_LOG_WARNING, "Unknown scaler preset %s\n", tmp);
+    }
+
     /* crop */
     ppvfs->is_crop = 0;
     ppvfs->crop = ppvfs->result;
@@ -487,7 +1280,7 @@ static void pre_process_init(AVDictionary *options, struct PreProcessSettings *p
     }
 }
 
-static int pre_process_video_frame(struct PreProcessSettings *ppvfs, AVFrame *frame)
+static int pre_process_video_frame(struct PreProcessSettings *ppvfs, AVFrame *frame, struct BandScaler *band)
 {
     int ret = 0;
 
@@ -510,10 +1303,12 @@ static int pre_process_video_frame(struct PreProcessSettings *ppvfs, AVFrame *fr
     }
 
     /* resize */
-    if (ppvfs->is_resample) {
+    if (ppvfs->is_resample && band && band_scaler_take(band, frame)) {
+        av_dlog(NULL, "Frame was scaled by bands\n");
+    } else if (ppvfs->is_resample) {
         /* HACK: because of deinterlace implementation */
         uint8_t *tmp = frame->data[0];
-        ret = resample_frame(frame, &ppvfs->resample);
+        ret = resample_frame(frame, &ppvfs->resample, ppvfs->scaler);
         if (ret > 0 && ppvfs->is_deinterlace)
             av_free(tmp);
     }
@@ -521,6 +1316,114 @@ static int pre_process_video_frame(struct PreProcessSettings *ppvfs, AVFrame *fr
     return ret;
 }
 
+static void frame_cache_init(struct FrameCache *cache, int64_t max_size)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->max_size = max_size;
+}
+
+static void frame_cache_entry_free(struct FrameCache *cache,
+                                   struct FrameCacheEntry *entry)
+{
+    cache->size -= entry->size;
+    avpicture_free(&entry->pic);
+    av_free(entry);
+}
+
+/* returns frame pointing to cached picture, which must not be freed */
+static AVFrame *frame_cache_get(struct FrameCache *cache, int64_t ts,
+                                struct PreProcessSettings *ppvfs)
+{
+    struct FrameCacheEntry **p, *entry;
+    AVFrame *frame;
+
+    for (p = &cache->head; (entry = *p); p = &entry->next) {
+        if (ts < entry->first_ts || ts > entry->last_ts
+            || entry->is_deinterlace != ppvfs->is_deinterlace
+            || entry->is_crop != ppvfs->is_crop
+            || memcmp(&entry->changes, &ppvfs->result, sizeof(entry->changes)))
+            continue;
+
+        frame = avcodec_alloc_frame();
+        if (!frame)
+            break;
+
+        /* move to front */
+        *p = entry->next;
+        entry->next = cache->head;
+        cache->head = entry;
+
+        for (int i = 0; i < AV_NUM_DATA_POINTERS; ++i) {
+            frame->data[i] = entry->pic.data[i];
+            frame->linesize[i] = entry->pic.linesize[i];
+        }
+        frame->format = entry->picture.format;
+        frame->width  = entry->picture.width;
+        frame->height = entry->picture.height;
+
+        cache->hits++;
+        return frame;
+    }
+
+    cache->misses++;
+    return NULL;
+}
+
+/* stores copy of preprocessed frame, evicting least recently used ones */
+static void frame_cache_put(struct FrameCache *cache, int64_t first_ts,
+                            int64_t last_ts, struct PreProcessSettings *ppvfs,
+                            AVFrame *frame)
+{
+    struct FrameCacheEntry **p, *entry;
+    int size = avpicture_get_size(frame->format, frame->width, frame->height);
+
+    if (size <= 0 || size > cache->max_size)
+        return;
+
+    while (cache->head && cache->size + size > cache->max_size) {
+        /* find tail */
+        for (p = &cache->head; (*p)->next; p = &(*p)->next);
+        entry = *p;
+        *p = NULL;
+        frame_cache_entry_free(cache, entry);
+    }
+
+    entry = av_mallocz(sizeof(*entry));
+    if (!entry)
+        return;
+    if (avpicture_alloc(&entry->pic, frame->format,
+                        frame->width, frame->height) < 0) {
+        av_free(entry);
+        return;
+    }
+    av_picture_copy(&entry->pic, (AVPicture *) frame, frame->format,
+                    frame->width, frame->height);
+
+    entry->first_ts = first_ts;
+    entry->last_ts  = last_ts;
+    entry->changes  = ppvfs->result;
+    entry->is_deinterlace = ppvfs->is_deinterlace;
+    entry->is_crop  = ppvfs->is_crop;
+    entry->picture.format = frame->format;
+    entry->picture.width  = frame->width;
+    entry->picture.height = frame->height;
+    entry->size = size;
+
+    entry->next = cache->head;
+    cache->head = entry;
+    cache->size += size;
+}
+
+static void frame_cache_free(struct FrameCache *cache)
+{
+    struct FrameCacheEntry *entry;
+
+    while ((entry = cache->head)) {
+        cache->head = entry->next;
+        frame_cache_entry_free(cache, entry);
+    }
+}
+
 static inline int process_video(AVDictionary *options)
 {
     int ret = 0;
@@ -533,32 +1436,88 @@ static inline int process_video(AVDictionary *options)
     AVCodecContext *enc_ctx = NULL;
     struct PreProcessSettings ppvfs;
     AVDictionaryEntry *e = NULL;
+    struct AsyncWriter writer, *writer_ptr = NULL;
+    struct BandScaler band, *band_ptr = NULL;
+    struct FrameCache cache, *cache_ptr = NULL;
+    struct EncoderPool pool, *pool_ptr = NULL;
+    const struct EncoderPreset *preset = &encoder_presets[1];
+    char *tmp;
+    AVInputFormat *in_format = NULL;
+    AVDictionary *open_opts = NULL;
+    int header_only, probe_streams = 1;
+    int64_t start_time, first_frame_time = AV_NOPTS_VALUE;
 
     /* register all formats and codecs */
     av_register_all();
 
+    start_time = av_gettime();
+
     /* take pointers to input file and output template */
     src_filename = av_dict_get_fcval(options, "input");
     out_template = av_dict_get_fcval(options, "output");
 
+    /* force input format instead of probing it */
+    tmp = av_dict_get_fcval(options, "format");
+    if (tmp) {
+        in_format = av_find_input_format(tmp);
+        if (!in_format) {
+            av_log(NULL, AV_LOG_FATAL, "Unknown input format '%s'\n", tmp);
+            ret = AVERROR(EINVAL);
+            goto end;
+        }
+    }
+
+    /* bound amount of data read and decoded before first seek */
+    if (av_dict_get_fcval(options, "fast_open")) {
+        av_dict_set(&open_opts, "probesize", "131072", 0);
+        av_dict_set(&open_opts, "analyzeduration", "500000", 0);
+    }
+    tmp = av_dict_get_fcval(options, "probesize");
+    if (tmp)
+        av_dict_set(&open_opts, "probesize", tmp, 0);
+    tmp = av_dict_get_fcval(options, "analyzeduration");
+    if (tmp)
+        av_dict_set(&open_opts, "analyzeduration", tmp, 0);
+
     /* open input file, and allocate format context */
-    if (avformat_open_input(&fmt_ctx, src_filename, NULL, NULL) < 0) {
+    if (avformat_open_input(&fmt_ctx, src_filename, in_format, &open_opts) < 0) {
         av_log(NULL, AV_LOG_FATAL, "Could not open source file '%s'\n", src_filename);
         ret = AVERROR(EIO);
         goto end;
     }
 
+    e = NULL;
+    while ((e = av_dict_get(open_opts, "", e, AV_DICT_IGNORE_SUFFIX)))
+        av_log(NULL, AV_LOG_WARNING, "Option %s was not used\n", e->key);
+
+    /* header is enough only if it gives size and pixel format, decided
+     * before opening decoder, since probing closes stream codecs */
+    header_only = !!av_dict_get_fcval(options, "header_only");
+    if (header_only) {
+        AVCodecContext *codec;
+
+        ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        codec = ret >= 0 ? fmt_ctx->streams[ret]->codec : NULL;
+        if (codec && codec->width && codec->height
+                  && codec->pix_fmt != PIX_FMT_NONE)
+            probe_streams = 0;
+        else if (codec)
+            /* usual for H.264 and most other codecs, which learn pixel
+             * format from first decoded slice */
+            av_log(NULL, AV_LOG_INFO, "Header only: pixel format of video"
+                   " stream is known only after decoding, reading stream info\n");
+        else
+            av_log(NULL, AV_LOG_INFO, "Header only: no video stream in header,"
+                                      " reading stream info\n");
+    }
+
     /* retrieve stream information */
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+    if (probe_streams && avformat_find_stream_info(fmt_ctx, NULL) < 0) {
         av_log(NULL, AV_LOG_FATAL, "Could not find stream information\n");
         ret = AVERROR(EIO);
         goto end;
     }
 
-    /* dump input format information */
-    if (av_log_get_level() >= AV_LOG_VERBOSE)
-        av_dump_format(fmt_ctx, 0, src_filename, 0);
-
     /* find best stream and open codec contex */
     ret = open_codec_context(&stream_idx, fmt_ctx, AVMEDIA_TYPE_VIDEO);
     if (ret >= 0) {
@@ -569,8 +1528,28 @@ static inline int process_video(AVDictionary *options)
     } else
         goto end;
 
+    /* dump input format information */
+    if (av_log_get_level() >= AV_LOG_VERBOSE)
+        av_dump_format(fmt_ctx, 0, src_filename, 0);
+
+    av_log(NULL, AV_LOG_VERBOSE, "Input opened in %"PRId64" ms\n",
+                                 (av_gettime() - start_time) / 1000);
+
+    /* choose encoder preset */
+    tmp = av_dict_get_fcval(options, "preset");
+    if (tmp) {
+        unsigned i;
+        for (i = 0; i < FF_ARRAY_ELEMS(encoder_presets); ++i)
+            if (!strcmp(tmp, encoder_presets[i].name))
+                break;
+        if (i < FF_ARRAY_ELEMS(encoder_presets))
+            preset = &encoder_presets[i];
+        else
+            av_log(NULL, AV_LOG_WARNING, "Unknown encoder preset %s\n", tmp);
+    }
+
     /* init encoder context */
-    init_encoder_context(out_template, dec_ctx, &out_fmt_ctx, &enc_ctx);
+    init_encoder_context(out_template, dec_ctx, preset, &out_fmt_ctx, &enc_ctx);
     if (!out_fmt_ctx || !enc_ctx) {
         goto end;
     }
@@ -584,6 +1563,20 @@ static inline int process_video(AVDictionary *options)
     enc_ctx->width  = ppvfs.result.width;
     enc_ctx->height = ppvfs.result.height;
 
+    /* scale decoded bands while they are hot, when it is possible */
+    if (av_dict_get_fcval(options, "slice_scale")) {
+        if (!(dec_ctx->codec->capabilities & CODEC_CAP_DRAW_HORIZ_BAND))
+            av_log(NULL, AV_LOG_VERBOSE, "Decoder %s does not provide bands,"
+                   " frames will be scaled whole\n", dec_ctx->codec->name);
+        else if (!ppvfs.is_resample || ppvfs.is_deinterlace || ppvfs.is_crop)
+            av_log(NULL, AV_LOG_VERBOSE, "Slice scaling does not apply"
+                   " with current settings, frames will be scaled whole\n");
+        else {
+            band_scaler_init(&band, dec_ctx, &ppvfs);
+            band_ptr = &band;
+        }
+    }
+
     /* open encoder codec */
     ret = avcodec_open2(enc_ctx, enc_ctx->codec, NULL);
     if (ret < 0) {
@@ -591,16 +1584,67 @@ static inline int process_video(AVDictionary *options)
         goto end;
     }
 
+    /* start writer thread, output files will be written in background */
+    if (av_dict_get_fcval(options, "async_write")) {
+        AVOutputFormat *oformat;
+        enum FsyncPolicy fsync = FSYNC_NONE;
+        int64_t max_in_flight = 64;
+
+        tmp = av_dict_get_fcval(options, "fsync");
+        if (!tmp || !strcmp(tmp, "none"))
+            fsync = FSYNC_NONE;
+        else if (!strcmp(tmp, "file"))
+            fsync = FSYNC_FILE;
+        else if (!strcmp(tmp, "end"))
+            fsync = FSYNC_END;
+        else
+            av_log(NULL, AV_LOG_WARNING, "Unknown fsync policy %s\n", tmp);
+
+        tmp = av_dict_get_fcval(options, "write_queue");
+        if (tmp && atoll(tmp) > 0)
+            max_in_flight = atoll(tmp);
+        max_in_flight <<= 20;
+
+        /* muxing to memory must not stay without thread writing it out */
+        oformat = out_fmt_ctx->oformat;
+        if (async_writer_prepare_format(out_fmt_ctx, out_template) < 0)
+            av_log(NULL, AV_LOG_WARNING, "Output format %s can not be written"
+                   " asynchronously\n", out_fmt_ctx->oformat->name);
+        else if (async_writer_init(&writer, max_in_flight, fsync) >= 0)
+            writer_ptr = &writer;
+        else
+            out_fmt_ctx->oformat = oformat;
+    }
+
+    /* encode several frames at once on different cores */
+    tmp = av_dict_get_fcval(options, "encoders");
+    if (tmp && atoi(tmp) > 1) {
+        ret = encoder_pool_init(&pool, atoi(tmp), out_template, dec_ctx,
+                                preset, &ppvfs.result, writer_ptr);
+        pool_ptr = &pool;
+        if (ret < 0)
+            goto end;
+    }
+
+    /* keep recent frames for timestamps resolving to the same frame */
+    tmp = av_dict_get_fcval(options, "frame_cache");
+    if (!tmp || atoll(tmp) > 0) {
+        frame_cache_init(&cache, (tmp ? atoll(tmp) : 32) << 20);
+        cache_ptr = &cache;
+    }
+
     /* iterate process procedure on every timestamp */
     while ((e = av_dict_get(options, "timestamp_", e, AV_DICT_IGNORE_SUFFIX))) {
         int64_t sec = atol(e->value), ts = sec;
-        AVFrame *frame;
+        int64_t first_ts, frame_ts;
+        AVFrame *frame = NULL;
+        int is_cached;
 
         /* calc frame from seconds */
         //ts = av_rescale_q(ts, AV_TIME_BASE_Q, stream->time_base);
         /* FIXME: check twice why we cant use AV_TIME_BASE_Q */
         ts = av_rescale_q(ts, AV_TIME_BASE_SEC, stream->time_base);
-        if (ts > stream->duration) {
+        if (stream->duration != (int64_t) AV_NOPTS_VALUE && ts > stream->duration) {
             av_log(NULL, AV_LOG_WARNING, "Timestamp %s is out of duration\n", e->value);
             continue;
         }
@@ -609,6 +1653,16 @@ static inline int process_video(AVDictionary *options)
         if (stream->start_time != (int64_t) AV_NOPTS_VALUE)
             ts += stream->start_time;
 
+        /* same frame could be already decoded for previous timestamp */
+        if (cache_ptr)
+            frame = frame_cache_get(cache_ptr, ts, &ppvfs);
+        is_cached = !!frame;
+        if (is_cached) {
+            av_log(NULL, AV_LOG_VERBOSE, "Frame for %"PRId64" (%"PRId64"s)"
+                                         " found in cache\n", ts, sec);
+            goto encode;
+        }
+
         /* fast seek to timestamp */
         av_log(NULL, AV_LOG_INFO, "seeking to %"PRId64" (%"PRId64"s)\n", ts, sec);
         /* TODO: only use seek for far jump. Look at keyframes (keyint, I-frame) */
@@ -620,26 +1674,49 @@ static inline int process_video(AVDictionary *options)
 
         /* TODO: call only when seek was success? */
         avcodec_flush_buffers(dec_ctx);
+        if (band_ptr)
+            band_scaler_reset(band_ptr, ts);
 
         /* aquire frame from input at given timestamp */
-        frame = aquire_frame(fmt_ctx, dec_ctx, stream_idx, ts);
+        frame = aquire_frame(fmt_ctx, dec_ctx, stream_idx, ts, band_ptr,
+                             &first_ts, &frame_ts);
+encode:
         if (frame) {
-            /* preprocess video: deinterlace, crop, pad, resize and etc. */
-            ret = pre_process_video_frame(&ppvfs, frame);
-            if (ret < 0)
-                goto free_frame;
+            if (first_frame_time == (int64_t) AV_NOPTS_VALUE) {
+                first_frame_time = av_gettime() - start_time;
+                av_log(NULL, AV_LOG_INFO, "Time to first frame %"PRId64" ms\n",
+                                          first_frame_time / 1000);
+            }
+
+            if (!is_cached) {
+                /* preprocess video: deinterlace, crop, pad, resize and etc. */
+                ret = pre_process_video_frame(&ppvfs, frame, band_ptr);
+                if (ret < 0)
+                    goto free_frame;
+
+                /* copy is worth it only if more timestamps follow */
+                if (cache_ptr && frame_ts != (int64_t) AV_NOPTS_VALUE
+                    && av_dict_get(options, "timestamp_", e, AV_DICT_IGNORE_SUFFIX))
+                    frame_cache_put(cache_ptr, first_ts, frame_ts, &ppvfs, frame);
+            }
 
             /* expand template and set output filename  */
             snprintf(out_fmt_ctx->filename, sizeof(out_fmt_ctx->filename),
                      out_template, sec);
 
-            /* encode frame */
-            ret = encode_video_frame(out_fmt_ctx, enc_ctx, frame);
-            if (ret < 0)
-                goto free_frame;
+            /* encode frame, picture produced by resample is given away */
+            if (pool_ptr && !is_cached && ppvfs.is_resample) {
+                ret = encoder_pool_push(pool_ptr, frame,
+                                        out_fmt_ctx->filename, 1);
+                continue;
+            } else if (pool_ptr)
+                ret = encoder_pool_push(pool_ptr, frame,
+                                        out_fmt_ctx->filename, 0);
+            else
+                ret = encode_video_frame(out_fmt_ctx, enc_ctx, frame, writer_ptr);
 
             /* HACK: free buffer because of deinterlace or resample */
-            if (ppvfs.is_deinterlace || ppvfs.is_resample)
+            if (!is_cached && (ppvfs.is_deinterlace || ppvfs.is_resample))
                 av_free(frame->data[0]);
 free_frame:
             av_free(frame);
@@ -647,6 +1724,24 @@ free_frame:
             av_log(NULL, AV_LOG_ERROR, "Frame decoding was failed\n");
     }
 end:
+    if (cache_ptr) {
+        /* single timestamp can not hit, nothing to report then */
+        if (cache_ptr->hits + cache_ptr->misses > 1)
+            av_log(NULL, AV_LOG_INFO, "Frame cache hits:%d misses:%d\n",
+                                      cache_ptr->hits, cache_ptr->misses);
+        frame_cache_free(cache_ptr);
+    }
+    /* encoders write through writer, so they are stopped first */
+    if (pool_ptr) {
+        int err = encoder_pool_close(pool_ptr);
+        if (err < 0 && ret >= 0)
+            ret = err;
+    }
+    if (writer_ptr) {
+        int err = async_writer_close(writer_ptr);
+        if (err < 0 && ret >= 0)
+            ret = err;
+    }
     if (out_fmt_ctx)
         avformat_free_context(out_fmt_ctx);
     if (enc_ctx) {
@@ -654,10 +1749,15 @@ end:
         av_free(enc_ctx);
     }
 
+    if (open_opts)
+        av_dict_free(&open_opts);
     if (fmt_ctx)
         avformat_close_input(&fmt_ctx);
     if (dec_ctx)
         avcodec_close(dec_ctx);
+    if (band_ptr)
+        band_scaler_free(band_ptr);
+    scaler_cache_release();
 
     return ret;
 }
@@ -673,9 +1773,33 @@ static void usage(const char *name)
            "-w, --width         set output width\n"
            "-h, --height        set output height\n"
            "-c, --crop          set crop height\n"
+           "-f, --format        force input format\n"
+           "-F, --fast-open     limit probing of input before first seek\n"
+           "    --probesize     max bytes to probe input streams\n"
+           "    --analyzeduration max microseconds to analyze input streams\n"
+           "    --header-only   skip reading stream info when container header has\n"
+           "                    size and pixel format (rarely so for H.264)\n"
+           "-p, --preset        encoder preset: fast, balanced (default) or small\n"
+           "-j, --encoders      number of encoder threads (default 1)\n"
+           "    --frame-cache   megabytes for recently decoded frames (default 32, 0 disables)\n"
+           "    --scaler        scaler preset: fast, balanced (default) or quality\n"
+           "-s, --slice-scale   scale decoded slices on the fly when codec allows\n"
+           "-a, --async-write   write output files from separate thread\n"
+           "    --fsync         fsync policy: none (default), file or end\n"
+           "    --write-queue   megabytes allowed to wait for writing (default 64)\n"
            , name);
 }
 
+enum {
+    OPT_FSYNC = 256,
+    OPT_WRITE_QUEUE,
+    OPT_PROBESIZE,
+    OPT_ANALYZEDURATION,
+    OPT_HEADER_ONLY,
+    OPT_SCALER,
+    OPT_FRAME_CACHE,
+};
+
 int main(int argc, char **argv)
 {
     int ret = EXIT_SUCCESS;
@@ -683,7 +1807,7 @@ int main(int argc, char **argv)
 
     /* parse arguements passed to program */
     int c = -1, option_index = 0;
-    const char *short_options = "?i:o:dv::w:h:c:";
+    const char *short_options = "?i:o:dv::w:h:c:f:Fsap:j:";
     const struct option long_options[] = {
         {"help",        no_argument,       NULL, '?'},
         {"input",       required_argument, NULL, 'i'},
@@ -693,6 +1817,19 @@ int main(int argc, char **argv)
         {"width",       required_argument, NULL, 'w'},
         {"height",      required_argument, NULL, 'h'},
         {"crop",        required_argument, NULL, 'c'},
+        {"format",      required_argument, NULL, 'f'},
+        {"fast-open",   no_argument,       NULL, 'F'},
+        {"probesize",   required_argument, NULL, OPT_PROBESIZE},
+        {"analyzeduration", required_argument, NULL, OPT_ANALYZEDURATION},
+        {"header-only", no_argument,       NULL, OPT_HEADER_ONLY},
+        {"preset",      required_argument, NULL, 'p'},
+        {"encoders",    required_argument, NULL, 'j'},
+        {"scaler",      required_argument, NULL, OPT_SCALER},
+        {"frame-cache", required_argument, NULL, OPT_FRAME_CACHE},
+        {"slice-scale", no_argument,       NULL, 's'},
+        {"async-write", no_argument,       NULL, 'a'},
+        {"fsync",       required_argument, NULL, OPT_FSYNC},
+        {"write-queue", required_argument, NULL, OPT_WRITE_QUEUE},
         {NULL,          0,                 NULL, 0}
     };
 
@@ -720,6 +1857,45 @@ int main(int argc, char **argv)
         case 'd':
             av_dict_set(&options, "deinterlace", "", 0);
             break;
+        case 'f':
+            av_dict_set(&options, "format", optarg, 0);
+            break;
+        case 'F':
+            av_dict_set(&options, "fast_open", "", 0);
+            break;
+        case OPT_PROBESIZE:
+            av_dict_set(&options, "probesize", optarg, 0);
+            break;
+        case OPT_ANALYZEDURATION:
+            av_dict_set(&options, "analyzeduration", optarg, 0);
+            break;
+        case OPT_HEADER_ONLY:
+            av_dict_set(&options, "header_only", "", 0);
+            break;
+        case 'p':
+            av_dict_set(&options, "preset", optarg, 0);
+            break;
+        case 'j':
+            av_dict_set(&options, "encoders", optarg, 0);
+            break;
+        case OPT_FRAME_CACHE:
+            av_dict_set(&options, "frame_cache", optarg, 0);
+            break;
+        case OPT_SCALER:
+            av_dict_set(&options, "scaler", optarg, 0);
+            break;
+        case 's':
+            av_dict_set(&options, "slice_scale", "", 0);
+            break;
+        case 'a':
+            av_dict_set(&options, "async_write", "", 0);
+            break;
+        case OPT_FSYNC:
+            av_dict_set(&options, "fsync", optarg, 0);
+            break;
+        case OPT_WRITE_QUEUE:
+            av_dict_set(&options, "write_queue", optarg, 0);
+            break;
         case 'v':
             av_dict_set(&options, "verbose", optarg, 0);
             if (optarg) {
@@ -5,7 +5,7 @@ CONFIG -= qt
 SOURCES += \
     salfet.c
 
-LIBS += -lavformat -lavfilter -lavcodec -lswscale -lavutil
+LIBS += -lavformat -lavfilter -lavcodec -lswscale -lavutil -lpthread
 
 QMAKE_CFLAGS = -std=c99
 